@@ -120,13 +120,6 @@ void setup() {
     delay(1000);
 }
 
-// Returns a positive reminder which in range of [0..(b-1)]
-int8_t modulo(int8_t a, int8_t b) {
-    int8_t m = a % b;
-    if(m < 0) m = (b < 0) ? m - b : m + b;
-    return m;
-}
-
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(0 [arr]))
 
 const uint16_t lifeCellsThreashold = (HEIGHT >> 3) * (WIDTH >> 3);
@@ -148,36 +141,55 @@ bool life_is_stalled(uint16_t sum) {
 uint16_t frame = 0;
 uint8_t wave = WIDTH;
 
-uint8_t cell(int16_t x, int16_t y) {
-    return (display.getPixel(x, y) == 0xFF) ? 1 : 0;
+// Cells are processed as packed rows (32 cells per word)
+const uint8_t WORDS = (WIDTH + 31) / 32;
+uint32_t cells[HEIGHT][WORDS];
+
+// Add bit mask of neighbours to the bit-sliced counter (each cell has own counter bits).
+// Counter saturates at 4 (bit s2) which is enough for Life rules.
+inline void count(uint32_t n, uint32_t& s0, uint32_t& s1, uint32_t& s2) {
+    uint32_t c0 = s0 & n;
+    s0 ^= n;
+    uint32_t c1 = s1 & c0;
+    s1 ^= c0;
+    s2 |= c1;
 }
 
 void loop() {
     Serial.println(++frame);
 
+    for(uint8_t y = 0; y < HEIGHT; ++y)
+        display.readRow(y, cells[y]);
+
     uint16_t sum = 0;
+    uint32_t left[3][WORDS];
+    uint32_t right[3][WORDS];
+    uint32_t next[WORDS];
     for(uint8_t y = 0; y < HEIGHT; ++y) {
-        for(uint8_t x = 0; x < WIDTH; ++x) {
-            int8_t xPrev = modulo(x - 1, WIDTH);
-            int8_t xNext = modulo(x + 1, WIDTH);
-            int8_t yPrev = modulo(y - 1, HEIGHT);
-            int8_t yNext = modulo(y + 1, HEIGHT);
-            uint8_t neighbours = cell(xPrev, y) + cell(xNext, y) +
-                cell(xPrev, yPrev) + cell(x, yPrev) + cell(xNext, yPrev) +
-                cell(xPrev, yNext) + cell(x, yNext) + cell(xNext, yNext);
-            uint8_t current = cell(x, y);
-            sum += current;
-            if(current) {
-                if(neighbours < 2 || neighbours > 3) {
-                    current = 0;
-                }
-            } else {
-                if(neighbours == 3) {
-                    current = 1;
-                }
-            }
-            display.drawPixel(x, y, current ? 0xFF : 0);
+        const uint32_t* rows[3] = {
+            cells[(y + HEIGHT - 1) % HEIGHT],
+            cells[y],
+            cells[(y + 1) % HEIGHT]
+        };
+        for(uint8_t i = 0; i < 3; ++i) {
+            PxMATRIX::rotateRow(left[i], rows[i], WIDTH, 1);
+            PxMATRIX::rotateRow(right[i], rows[i], WIDTH, -1);
+        }
+        for(uint8_t w = 0; w < WORDS; ++w) {
+            uint32_t s0 = 0, s1 = 0, s2 = 0;
+            count(left[0][w], s0, s1, s2);
+            count(rows[0][w], s0, s1, s2);
+            count(right[0][w], s0, s1, s2);
+            count(left[1][w], s0, s1, s2);
+            count(right[1][w], s0, s1, s2);
+            count(left[2][w], s0, s1, s2);
+            count(rows[2][w], s0, s1, s2);
+            count(right[2][w], s0, s1, s2);
+            // Cell lives with 3 neighbours, or with 2 neighbours if it was alive
+            next[w] = ~s2 & s1 & (s0 | rows[1][w]);
         }
+        sum += PxMATRIX::countRow(rows[1], WIDTH);
+        display.writeRow(y, next);
     }
     hist[hist_idx] = sum;
     if(++hist_idx == ARRAY_SIZE(hist))
@@ -18,6 +18,23 @@ BSD license, check LICENSE for more information
 #error "PxMATRIX_COLOR_DEPTH must be 1 to 8 bits maximum"
 #endif
 
+// Temporal dithering (frame rate control) extra bits of grayscale depth
+// Each pixel keeps PxMATRIX_DITHER_BITS more bits of level, and its lowest displayed bit
+// is varied from frame to frame in an ordered pattern to render intermediate levels.
+// NOTE: it doesn't slow down the update, but takes more memory and requires higher refresh rate
+#ifndef PxMATRIX_DITHER_BITS
+#define PxMATRIX_DITHER_BITS 0
+#endif
+#if PxMATRIX_DITHER_BITS > 2 || PxMATRIX_DITHER_BITS < 0
+#error "PxMATRIX_DITHER_BITS must be 0 to 2 bits maximum"
+#endif
+#if PxMATRIX_COLOR_DEPTH + PxMATRIX_DITHER_BITS > 8
+#error "PxMATRIX_COLOR_DEPTH with PxMATRIX_DITHER_BITS must be 8 bits maximum"
+#endif
+
+// Number of bit planes stored per buffer (displayed planes followed by dithering planes)
+#define PxMATRIX_BUFFER_PLANES (PxMATRIX_COLOR_DEPTH + PxMATRIX_DITHER_BITS)
+
 // Number of color components:
 //  1 for monochrome,
 //  3 for RGB - not supported, use original PxMatrix library
@@ -62,6 +79,20 @@ BSD license, check LICENSE for more information
 #endif
 #endif
 
+// Shadow buffer with a byte per pixel for drawing (encoded into bit planes by showBuffer)
+#ifdef PxMATRIX_SHADOW_BUFFER
+#if PxMATRIX_SHADOW_BUFFER == 0
+#undef PxMATRIX_SHADOW_BUFFER
+#endif
+#endif
+
+// Number of display buffers
+#ifdef PxMATRIX_DOUBLE_BUFFER
+#define PxMATRIX_BUFFER_COUNT 2
+#else
+#define PxMATRIX_BUFFER_COUNT 1
+#endif
+
 #include "Adafruit_GFX.h"
 
 #ifdef __AVR__
@@ -72,6 +103,8 @@ BSD license, check LICENSE for more information
 #include "PxMatrix_gamma.h"
 #endif
 
+#include "PxMatrix_refresh.h"
+
 class PxMATRIX : public Adafruit_GFX
 {
 public:
@@ -83,16 +116,21 @@ public:
         Output_Pins() = delete;
         
         inline Output_Pins(const std::initializer_list<uint8_t>& list)
-          : size{ (uint8_t)list.size() }, arr{ _Copy(list.begin(), size) } {};
+          : size{ (uint8_t)list.size() }, arr{ _Copy(list.begin(), size) }, owned{ true } {};
+
+        // Refer to the pins of a static array without copying (no heap allocation)
+        template<size_t N>
+        inline Output_Pins(const uint8_t (&list)[N])
+          : size{ (uint8_t)N }, arr{ list }, owned{ false } {};
         
         inline Output_Pins(const Output_Pins& v)
-          : size{ v.size }, arr{ _Copy(v.arr, v.size) } {};
+          : size{ v.size }, arr{ v.owned ? _Copy(v.arr, v.size) : v.arr }, owned{ v.owned } {};
 
         inline Output_Pins(Output_Pins&& v)
-          : size{ v.size }, arr{ v._Release() } {};
+          : size{ v.size }, arr{ v._Release() }, owned{ v.owned } {};
 
         inline ~Output_Pins() {
-            if(arr != nullptr) {
+            if(owned && arr != nullptr) {
                 delete[] arr;
                 arr = nullptr;
             }
@@ -121,6 +159,8 @@ public:
         const uint8_t  size;
     protected:
         const uint8_t* arr;
+        // Array is allocated by this object
+        const bool owned;
     };
 
     // Create output display for LED matrix
@@ -144,11 +184,69 @@ public:
         : Adafruit_GFX(width, height)
         , _OE_PIN{OE}, _LATCH_PINS{std::move(LATCH)}, _MUX_PINS{std::move(MUX)} { init(); }
 
+    // Create output display with display buffers placed into the storage provided by caller (no heap allocation)
+    // Storage size is given by "getBufferMemorySize" (if storage is too small, buffers are allocated on heap).
+    // Pins can be passed as static arrays to avoid heap allocation too.
+    inline PxMATRIX(uint16_t width, uint16_t height, const Output_Pins& LATCH, uint8_t OE, const Output_Pins& MUX,
+                    uint8_t* storage, uint32_t storage_size)
+        : Adafruit_GFX(width, height)
+        , _OE_PIN{OE}, _LATCH_PINS{LATCH}, _MUX_PINS{MUX} { init(storage, storage_size); }
+
+    inline ~PxMATRIX();
+
+    // Display owns its buffers, so it can't be copied
+    PxMATRIX(const PxMATRIX&) = delete;
+    PxMATRIX& operator=(const PxMATRIX&) = delete;
+
+    // Bytes of memory for display buffers of the display size (see constructor with storage)
+    static constexpr uint32_t getBufferMemorySize(uint16_t width, uint16_t height) {
+        return (uint32_t)width * height * PxMATRIX_COLOR_COMP / 8
+            * (PxMATRIX_BUFFER_COUNT * PxMATRIX_BUFFER_PLANES + (PxMATRIX_DITHER_BITS > 0 ? PxMATRIX_COLOR_DEPTH : 0))
+#ifdef PxMATRIX_SHADOW_BUFFER
+            + (uint32_t)width * height + PxMATRIX_BUFFER_COUNT * ((height + 7) / 8)
+#endif
+            ;
+    }
+
+    // Refresh program is compiled by "begin" and recompiled when show time, brightness or mux delays are changed:
+    // time to light up LEDs for each bit plane, and on ESP the GPIO masks to select each scan line at once.
+    // Data of a scan line is at plane * buffer size + (latch line * row_pattern + row) * scan line size in the buffer.
+#if defined(ESP8266) || defined(ESP32)
+    struct Mux_Mask {
+        uint32_t set;   // GPIO bits to set for the mux value
+        uint32_t clear; // GPIO bits to clear for the mux value
+    };
+#endif
+
+    // Time to light up LEDs of each scan line of the bit plane in microseconds
+    inline uint16_t getPlaneTime(uint8_t plane) const;
+
+#if defined(ESP8266) || defined(ESP32)
+    // GPIO masks for each scan line (nullptr if mux pins are set by digitalWrite)
+    inline const Mux_Mask* getMuxMasks() const;
+#endif
+
+    // Bytes of memory for scan line tables of the scan pattern and number of latch pins (see "begin" with storage)
+    // NOTE: the storage for the largest scan pattern can be reused for smaller ones
+    static constexpr uint16_t getRowsMemorySize(uint8_t row_pattern, uint8_t latch_pins) {
+        return (uint16_t)row_pattern * latch_pins * (sizeof(uint16_t) + PxMATRIX_BUFFER_COUNT)
+#if defined(ESP8266) || defined(ESP32)
+            + row_pattern * sizeof(Mux_Mask) + (alignof(Mux_Mask) - 1) // with alignment
+#endif
+            ;
+    }
+
     // Prepare to render display
     // row_pattern = number of scan lines to display whole image (defined by hardware)
     //   Typical display scan rates: 1/4, 1/8, 1/16, 1/32
+    // Can be called again to change the scan pattern or matrix size.
     inline void begin(uint8_t row_pattern = 4);
 
+    // Prepare to render display with scan line tables placed into the storage provided by caller (no heap allocation)
+    // Storage size is given by "getRowsMemorySize".
+    // Returns false if storage is too small (tables are allocated on heap then)
+    inline bool begin(uint8_t row_pattern, uint8_t* storage, uint16_t storage_size);
+
     // Clear display buffer
     inline void clearDisplay(Buffer_Type selected_buffer = Buffer_Type::INACTIVE);
 
@@ -158,9 +256,53 @@ public:
     // Draw pixel
     inline void drawPixel(int16_t x, int16_t y, uint16_t color = 0xFF) override;
 
+    // Write transaction (used by Adafruit GFX drawing primitives)
+    // Drawing buffer is resolved once in startWrite, then writePixel calls just store pixels.
+    // NOTE: don't swap buffers (showBuffer) within the transaction
+    inline void startWrite() override;
+    inline void writePixel(int16_t x, int16_t y, uint16_t color) override;
+    inline void endWrite() override;
+
+    struct Point {
+        int16_t x;
+        int16_t y;
+    };
+
+    // Draw pixels at the points with the same color
+    inline void drawPixels(const Point* points, uint16_t count, uint16_t color = 0xFF);
+
+    // Draw pixels at the points with own colors
+    inline void drawPixels(const Point* points, const uint8_t* colors, uint16_t count);
+
     // Read pixel
+    // NOTE: with shadow buffer it returns the drawn color (selected_buffer is ignored)
     uint8_t getPixel(int16_t x, int16_t y, Buffer_Type selected_buffer = Buffer_Type::ACTIVE);
 
+    // Packed rows of pixels for bitwise processing (for example cellular automata)
+    // Pixel x of the row is a bit (x % 32) of the word (x / 32), set bit means a lit pixel.
+    static const uint8_t PLANES_ALL = 0xFF;
+
+    // Number of pixels in a row (depends on rotation)
+    inline uint16_t getRowWidth() const;
+
+    // Number of 32-bit words to hold a packed row
+    inline uint8_t getRowWords() const;
+
+    // Read a bit plane of a row into packed words (the highest displayed plane by default)
+    inline void readRow(int16_t y, uint32_t* row, uint8_t plane = PxMATRIX_COLOR_DEPTH - 1, Buffer_Type selected_buffer = Buffer_Type::ACTIVE);
+
+    // Write packed words into a bit plane of a row
+    // With PLANES_ALL set bits are drawn at full level and cleared bits are drawn black
+    inline void writeRow(int16_t y, const uint32_t* row, uint8_t plane = PLANES_ALL, Buffer_Type selected_buffer = Buffer_Type::INACTIVE);
+
+    // Rotate packed row by one pixel with wrap around
+    //   dir > 0 - dst[x] = src[x - 1] (moves pixels to the right)
+    //   dir < 0 - dst[x] = src[x + 1] (moves pixels to the left)
+    static inline void rotateRow(uint32_t* dst, const uint32_t* src, uint16_t width, int8_t dir);
+
+    // Count set bits of packed row
+    static inline uint16_t countRow(const uint32_t* row, uint16_t width);
+
     // Flush the display registers (example at startup to purge previous data)
     // NOTE: It doesn't clear the buffer (use clearDisplay instead)
     inline void flushDisplay();
@@ -175,11 +317,18 @@ public:
     inline void setFastUpdate(bool fast_update);
 
     // When using double buffering, this swaps buffers makes new frame is ready to render
+    // With shadow buffer the changed rows are encoded into the drawing buffer before.
     inline void showBuffer();
 
     // When using double buffering, copy the display buffer to the drawing buffer (or reverse)
     inline void copyBuffer(bool reverse = false);
 
+    // Copy rectangle of pixels (w x h) at sx, sy of src_buffer to dx, dy of dst_buffer
+    // Source and destination can overlap (in the same buffer). Parts out of display are skipped.
+    // NOTE: with shadow buffer pixels are copied within drawn image (buffer types are ignored)
+    inline void copyRect(Buffer_Type src_buffer, int16_t sx, int16_t sy, int16_t w, int16_t h,
+                         Buffer_Type dst_buffer, int16_t dx, int16_t dy);
+
     // Set the time in microseconds that we pause after selecting each mux channel
     // (May help if some rows are missing / the mux chip is too slow)
     inline void setMuxDelay(uint8_t mux_delay_A, uint8_t mux_delay_B, uint8_t mux_delay_C = 0, uint8_t mux_delay_D = 0, uint8_t mux_delay_E = 0);
@@ -194,10 +343,56 @@ public:
     // Set the brightness of the panels (default is 255)
     inline void setBrightness(uint8_t brightness);
 
+    // Scan lines without lit pixels are skipped by display method, so it takes less time.
+    // Enable to give the saved time to the scan lines with lit pixels (sparse content gets brighter).
+    inline void setBlankBoost(bool blank_boost);
+
+    // Timings of display refresh and settings for the target refresh rate (see PxMatrix_refresh.h)
+    typedef PxMATRIX_Refresh_Timing   Refresh_Timing;
+    typedef PxMATRIX_Refresh_Settings Refresh_Settings;
+
+    // Measure refresh timings of the current configuration
+    // NOTE: call after "begin" and before display method is attached to the timer
+    inline Refresh_Timing measureRefresh(uint8_t repeats = 16);
+
+    // Compute the longest show time that keeps refresh rate (frames per second with all bit planes)
+    // max_load = percent of timer period that the longest display call may take (the rest is left to application)
+    // Returns false if refresh rate can't be reached
+    static inline bool calibrateRefresh(const Refresh_Timing& timing, uint16_t refresh_rate, uint8_t row_pattern, uint8_t lines,
+                                        Refresh_Settings& settings, uint8_t max_load = 75);
+
+    // Measure refresh timings and compute settings for this display
+    inline bool calibrateRefresh(uint16_t refresh_rate, Refresh_Settings& settings, uint8_t max_load = 75);
+
+#ifdef ESP32
+    // Statistics of the refresh task (see startRefresh)
+    struct Refresh_Stats {
+        uint32_t calls;      // Number of display calls
+        uint32_t overruns;   // Timer periods skipped because the task was late
+        uint16_t max_jitter; // Longest delay of display call after the timer tick in microseconds
+        uint16_t avg_jitter; // Average delay of display call after the timer tick in microseconds
+        uint16_t max_busy;   // Duration of the longest display call in microseconds
+    };
+
+    // Refresh the display by a dedicated task pinned to the core (instead of calling display method from the timer interruption).
+    // Timer interruption only wakes up the task, so SPI transfers don't block other interruptions.
+    // Show time and timer period are calibrated for the refresh rate (see calibrateRefresh).
+    // Only one display can be refreshed this way (use PxMATRIX_Scheduler for several displays).
+    // Returns false if refresh rate can't be reached or the task can't be started
+    inline bool startRefresh(uint16_t refresh_rate, uint8_t core = 1, uint8_t max_load = 75);
+
+    // Stop the refresh task (waits for the current display call to finish)
+    inline void stopRefresh();
+
+    // Statistics since the refresh task is started (reset clears them)
+    inline Refresh_Stats getRefreshStats(bool reset = false);
+#endif
+
 private:
     // Display buffer for the LED matrix
     // Array structure:
     // Whole buffer is splited into bit planes (color depth is used to display grayscale levels).
+    // With temporal dithering the lowest level bits are stored in extra planes after the displayed ones.
     // Each bit plane contain separate scan lines (by scan line pattern) so it can be send to display as continuous byte stream by SPI.
     // Each scanline buffer is splitted by number of color components (only 1 component is used for now).
     // Scanline buffer (for each color component) contains data for all matrix panels are sequenced in a chain.
@@ -209,6 +404,20 @@ private:
     // Second display buffer (_active_buffer flag controls what buffer is active rendering)
     uint8_t* PxMATRIX_buffer2;
 #endif
+#ifdef PxMATRIX_SHADOW_BUFFER
+    // Drawing buffer with a byte per pixel (WIDTH x HEIGHT without rotation)
+    // Pixels are drawn and read here, and bit planes are encoded by showBuffer.
+    uint8_t* PxMATRIX_shadow_buffer;
+    // Bit masks of shadow buffer rows changed since the last encoding into each display buffer
+    uint8_t* _shadow_dirty;
+#endif
+#if PxMATRIX_DITHER_BITS > 0
+    // Displayed bit planes of the active buffer with applied temporal dithering
+    // (rendered once per frame by method renderDither)
+    uint8_t* PxMATRIX_dither_buffer;
+    // Current frame of dithering pattern
+    uint8_t _dither_phase;
+#endif
 
     // GPIO pins
     const uint8_t _OE_PIN;
@@ -244,9 +453,63 @@ private:
     // Counts to PxMATRIX_COLOR_DEPTH (number of bits for color depth)
     uint8_t _display_color;
 
+    // Memory of display buffers and scan line tables is allocated by this object (or provided by caller)
+    bool _own_buffers;
+    bool _own_rows;
+
+    // Memory block of scan line tables
+    uint8_t* _rows_memory;
+
+    // Refresh program (see getPlaneTime) with its parameters
+    uint16_t _plane_time[PxMATRIX_COLOR_DEPTH];
+#if defined(ESP8266) || defined(ESP32)
+    Mux_Mask* _mux_masks;
+#endif
+    uint16_t _program_show_time;
+    uint8_t  _program_brightness;
+    // Mux is set by GPIO registers (otherwise by set_mux)
+    bool     _program_gpio;
+
+#ifdef ESP32
+    // Refresh task (see startRefresh)
+    TaskHandle_t volatile _refresh_task;
+    volatile bool         _refresh_run;
+    volatile uint32_t     _refresh_tick;
+    uint16_t              _refresh_show_time;
+    uint32_t              _refresh_period;
+    Refresh_Stats         _refresh_stats;
+    uint64_t              _refresh_jitter_sum;
+    portMUX_TYPE          _refresh_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
     // Holds some pre-computed values for faster pixel drawing
     uint16_t* _row_offset;
 
+    // Bit masks of bit planes with lit pixels for each scan line of each latch line (indexed as _row_offset).
+    // Bits are set when pixels are drawn and cleared with the buffer, so scan lines without bits are blank.
+    uint8_t* _lit_planes;
+#ifdef PxMATRIX_DOUBLE_BUFFER
+    uint8_t* _lit_planes2;
+#endif
+
+    // Bit mask of latch lines which registers are latched with blank data
+    uint16_t _blank_lines;
+    // Display all scan lines regardless of lit planes (to measure refresh timings)
+    bool     _scan_full;
+
+    // State of write transaction (see startWrite)
+    uint8_t  _write_depth;
+    uint8_t* _write_buffer;
+    uint8_t* _write_lit_planes;
+    uint8_t  _write_color;
+    uint8_t  _write_level;
+
+    // Scan state of the bit plane being displayed (see beginPlane and nextRow)
+    uint8_t* _scan_buffer;
+    uint8_t  _scan_plane_mask;
+    uint8_t  _scan_row;
+    uint16_t _scan_latch_time;
+
     // Total number of bytes that is pushed to the display at a time (single scan line)
     // = (HEIGHT / _row_pattern) * (WIDTH / 8) * PxMATRIX_COLOR_COMP
     uint16_t _send_buffer_size;
@@ -261,6 +524,7 @@ private:
     bool _rotate;
     bool _flip;
     bool _fast_update;
+    bool _blank_boost;
 
     // Delays for muxer channels
     uint8_t _mux_delay_A;
@@ -272,11 +536,45 @@ private:
     static const uint16_t BUFFER_OUT_OF_BOUNDS = UINT16_MAX;
 
 private:
-    inline void init();
+    inline void init(uint8_t* storage = nullptr, uint32_t storage_size = 0);
+
+    inline bool initRows(uint8_t* storage, uint16_t storage_size);
+
+    // Compute the refresh program for the show time
+    inline void compileProgram(uint16_t show_time);
 
     inline uint8_t* getBuffer(Buffer_Type selected_buffer);
 
-    inline uint16_t mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit);
+    inline uint8_t* getLitPlanes(Buffer_Type selected_buffer);
+
+#ifdef PxMATRIX_SHADOW_BUFFER
+    static const uint32_t SHADOW_OUT_OF_BOUNDS = UINT32_MAX;
+
+    inline uint8_t* getShadowDirty(Buffer_Type selected_buffer);
+
+    // Returns pixel index in the shadow buffer
+    inline uint32_t mapShadowIndex(int16_t x, int16_t y);
+
+    inline void fillShadowBuffer(int16_t x, int16_t y, uint8_t r);
+
+    // Encode changed rows of shadow buffer into bit planes of the drawing buffer
+    inline void encodeShadow();
+
+    template<bool FLIP>
+    inline void encodeShadow();
+#endif
+
+    // Returns byte index in the buffer plane, pixel bit in the byte and optionally the scan line index
+    inline uint16_t mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit, uint8_t* pLine = nullptr);
+
+    // Same as mapBufferIndex for the known rotation and flip
+    template<bool ROTATE, bool FLIP>
+    inline uint16_t mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit, uint8_t* pLine);
+
+    // Copy rectangle between buffers in not rotated coordinates (see copyRect)
+    template<bool FLIP>
+    inline void copyRect(Buffer_Type src_buffer, int16_t sx, int16_t sy, int16_t w, int16_t h,
+                         Buffer_Type dst_buffer, int16_t dx, int16_t dy);
 
     inline uint8_t mapColorLevel(uint8_t r);
 
@@ -284,7 +582,22 @@ private:
 
     inline void fillMatrixBuffer(int16_t x, int16_t y, uint8_t r, Buffer_Type selected_buffer);
 
-    inline uint16_t getLatchTime(uint16_t show_time);
+    inline void storeLevel(uint8_t* pBuffer, uint16_t nbyte, uint8_t nbit, uint8_t level);
+
+    // Draw pixels with colors array (optional) or the same color
+    inline void drawPixels(const Point* points, const uint8_t* colors, uint16_t count, uint8_t color);
+
+    template<bool ROTATE, bool FLIP>
+    inline void drawPixels(const Point* points, const uint8_t* colors, uint16_t count, uint8_t color);
+
+    static inline uint8_t reverseBits(uint8_t bits);
+
+    inline uint16_t getLatchTime(uint16_t show_time, uint8_t color);
+
+#if PxMATRIX_DITHER_BITS > 0
+    // Apply dithering pattern of the next frame to the active buffer
+    inline void renderDither();
+#endif
 
     // Light up LEDs and hold for show_time microseconds
     static const uint8_t LATCH_ALL = 0xFF;
@@ -294,6 +607,31 @@ private:
     // Set multiplexer scan line
     inline void set_mux(uint8_t value);
 
+    // Enable or disable LEDs output
+    inline void output(bool enable);
+
+    // Steps of displaying a bit plane (used by display method and PxMATRIX_Scheduler)
+    // beginPlane - prepares the current bit plane to display
+    // nextRow - sends and latches data of the next scan line to display (outputs must be disabled),
+    //   returns false when the bit plane is done
+    // endPlane - switches to the next bit plane
+    inline void beginPlane(uint16_t show_time);
+    inline bool nextRow();
+    inline void endPlane();
+
+    friend class PxMATRIX_Scheduler;
+
+#ifdef ESP32
+    // Display refreshed by the task
+    static inline PxMATRIX*& refreshInstance() {
+        static PxMATRIX* display = nullptr;
+        return display;
+    }
+
+    static inline void on_refresh_timer();
+    static inline void refresh_task(void* arg);
+#endif
+
     inline void spi_init();
 };
 
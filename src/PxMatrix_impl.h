@@ -62,12 +62,17 @@ BSD license, check LICENSE for more information
 #define PxMATRIX_DATA_CLEAR 0xFF
 #endif
 
+// Bit mask of all bit planes in the buffer
+#define PxMATRIX_PLANES_MASK ((uint8_t)(_BV(PxMATRIX_BUFFER_PLANES) - 1))
+
 inline void PxMATRIX::setMuxDelay(uint8_t mux_delay_A, uint8_t mux_delay_B, uint8_t mux_delay_C, uint8_t mux_delay_D, uint8_t mux_delay_E) {
     _mux_delay_A = mux_delay_A;
     _mux_delay_B = mux_delay_B;
     _mux_delay_C = mux_delay_C;
     _mux_delay_D = mux_delay_D;
     _mux_delay_E = mux_delay_E;
+    _program_show_time = 0; // recompile
+    _program_gpio = false;  // mux delays are applied by digitalWrite until then
 }
 
 inline void PxMATRIX::setPanelsWidth(uint8_t panels) {
@@ -103,7 +108,11 @@ inline void PxMATRIX::setBrightness(uint8_t brightness) {
     _brightness = brightness;
 }
 
-inline void PxMATRIX::init() {
+inline void PxMATRIX::setBlankBoost(bool blank_boost) {
+    _blank_boost = blank_boost;
+}
+
+inline void PxMATRIX::init(uint8_t* storage, uint32_t storage_size) {
     _row_pattern = 0;
     _panels_width = 1;
     _panels_height = _LATCH_PINS.size;
@@ -117,21 +126,93 @@ inline void PxMATRIX::init() {
     _rotate = 0;
     _flip = 0;
     _fast_update = 0;
+    _blank_boost = 0;
+    _blank_lines = 0;
+    _scan_full = false;
+    _scan_buffer = nullptr;
+    _scan_plane_mask = 0;
+    _scan_row = 0;
+    _scan_latch_time = 0;
+    _write_depth = 0;
+    _write_buffer = nullptr;
+    _write_lit_planes = nullptr;
+    _write_color = 0;
+    _write_level = 0;
+#ifdef ESP32
+    _refresh_task = nullptr;
+    _refresh_run = false;
+    _refresh_tick = 0;
+    _refresh_show_time = 0;
+    _refresh_period = 0;
+    _refresh_stats = Refresh_Stats{};
+    _refresh_jitter_sum = 0;
+#endif
+    _rows_memory = nullptr;
+#if defined(ESP8266) || defined(ESP32)
+    _mux_masks = nullptr;
+#endif
+    _program_show_time = 0;
+    _program_brightness = 0;
+    _program_gpio = false;
+    _row_offset = nullptr;
+    _lit_planes = nullptr;
+#ifdef PxMATRIX_DOUBLE_BUFFER
+    _lit_planes2 = nullptr;
+#endif
     _mux_delay_A = _mux_delay_B = _mux_delay_C = _mux_delay_D = _mux_delay_E = 0;
 
     _buffer_size = (uint16_t)(WIDTH * HEIGHT * PxMATRIX_COLOR_COMP / 8);
-    PxMATRIX_buffer = new uint8_t[PxMATRIX_COLOR_DEPTH * _buffer_size];
+    _own_rows = false;
+
+    // All buffers are placed in a single memory block
+    uint32_t memory_size = getBufferMemorySize(WIDTH, HEIGHT);
+    _own_buffers = (storage == nullptr || storage_size < memory_size);
+    if(_own_buffers)
+        storage = new uint8_t[memory_size];
+    PxMATRIX_buffer = storage;
+    storage += PxMATRIX_BUFFER_PLANES * _buffer_size;
 #ifdef PxMATRIX_DOUBLE_BUFFER
-    PxMATRIX_buffer2 = new uint8_t[PxMATRIX_COLOR_DEPTH * _buffer_size];
+    PxMATRIX_buffer2 = storage;
+    storage += PxMATRIX_BUFFER_PLANES * _buffer_size;
+#endif
+#if PxMATRIX_DITHER_BITS > 0
+    PxMATRIX_dither_buffer = storage;
+    storage += PxMATRIX_COLOR_DEPTH * _buffer_size;
+    _dither_phase = 0;
+#endif
+#ifdef PxMATRIX_SHADOW_BUFFER
+    // Start with black image to be encoded into all buffers
+    PxMATRIX_shadow_buffer = storage;
+    memset(PxMATRIX_shadow_buffer, 0, (uint32_t)WIDTH * HEIGHT);
+    storage += (uint32_t)WIDTH * HEIGHT;
+    _shadow_dirty = storage;
+    memset(_shadow_dirty, 0xFF, PxMATRIX_BUFFER_COUNT * ((HEIGHT + 7) / 8));
 #endif
 }
 
+inline PxMATRIX::~PxMATRIX() {
+#ifdef ESP32
+    stopRefresh();
+#endif
+    if(_own_rows)
+        delete[] _rows_memory;
+    if(_own_buffers)
+        delete[] PxMATRIX_buffer;
+}
+
 inline void PxMATRIX::drawPixel(int16_t x, int16_t y, uint16_t color) {
     uint8_t r = color & 0xFF;
+#ifdef PxMATRIX_SHADOW_BUFFER
+    fillShadowBuffer(x, y, r);
+#else
     fillMatrixBuffer(x, y, r, PxMATRIX::Buffer_Type::INACTIVE);
+#endif
 }
 
 inline void PxMATRIX::showBuffer() {
+#ifdef PxMATRIX_SHADOW_BUFFER
+    encodeShadow();
+#endif
     _active_buffer = !_active_buffer;
 }
 
@@ -152,24 +233,261 @@ inline uint8_t* PxMATRIX::getBuffer(PxMATRIX::Buffer_Type selected_buffer) {
     return PxMATRIX_buffer;
 }
 
+inline uint8_t* PxMATRIX::getLitPlanes(PxMATRIX::Buffer_Type selected_buffer) {
+#ifdef PxMATRIX_DOUBLE_BUFFER
+    switch(selected_buffer) {
+    case ACTIVE:
+        return _active_buffer ?  _lit_planes2 : _lit_planes;
+    case INACTIVE:
+        return _active_buffer ?  _lit_planes : _lit_planes2;
+    case FIRST:
+        return _lit_planes;
+    case SECOND:
+        return _lit_planes2;
+    }
+#endif
+    return _lit_planes;
+}
+
 inline void PxMATRIX::copyBuffer(bool reverse) {
 #ifdef PxMATRIX_DOUBLE_BUFFER
     // This copies the display buffer (active) to the drawing buffer (or reverse)
     // You may need this in case you rely on the framebuffer to always contain the last frame
     uint8_t* src = getBuffer(reverse ? PxMATRIX::Buffer_Type::INACTIVE : PxMATRIX::Buffer_Type::ACTIVE);
     uint8_t* dst = getBuffer(reverse ? PxMATRIX::Buffer_Type::ACTIVE : PxMATRIX::Buffer_Type::INACTIVE);
-    memcpy(dst, src, PxMATRIX_COLOR_DEPTH * _buffer_size);
+    memcpy(dst, src, PxMATRIX_BUFFER_PLANES * _buffer_size);
+    memcpy(getLitPlanes(reverse ? PxMATRIX::Buffer_Type::ACTIVE : PxMATRIX::Buffer_Type::INACTIVE),
+           getLitPlanes(reverse ? PxMATRIX::Buffer_Type::INACTIVE : PxMATRIX::Buffer_Type::ACTIVE),
+           _row_pattern * _LATCH_PINS.size);
+#ifdef PxMATRIX_SHADOW_BUFFER
+    // Copied buffer misses the same shadow rows as the source one
+    memcpy(getShadowDirty(reverse ? PxMATRIX::Buffer_Type::ACTIVE : PxMATRIX::Buffer_Type::INACTIVE),
+           getShadowDirty(reverse ? PxMATRIX::Buffer_Type::INACTIVE : PxMATRIX::Buffer_Type::ACTIVE),
+           (HEIGHT + 7) / 8);
+#endif
 #endif /* PxMATRIX_DOUBLE_BUFFER */
 }
 
-inline uint16_t PxMATRIX::mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit) {
+inline void PxMATRIX::copyRect(PxMATRIX::Buffer_Type src_buffer, int16_t sx, int16_t sy, int16_t w, int16_t h,
+                               PxMATRIX::Buffer_Type dst_buffer, int16_t dx, int16_t dy) {
+    if(_rotate) {
+        // Rotated rectangle is a rectangle in not rotated coordinates (see mapBufferIndex)
+        int16_t temp = sx;
+        sx = sy;
+        sy = HEIGHT - temp - w;
+        temp = dx;
+        dx = dy;
+        dy = HEIGHT - temp - w;
+        temp = w;
+        w = h;
+        h = temp;
+    }
+
+    // Clip rectangle by the display area
+    if(sx < 0) { w += sx; dx -= sx; sx = 0; }
+    if(dx < 0) { w += dx; sx -= dx; dx = 0; }
+    if(sy < 0) { h += sy; dy -= sy; sy = 0; }
+    if(dy < 0) { h += dy; sy -= dy; dy = 0; }
+    if(w > WIDTH - sx) w = WIDTH - sx;
+    if(w > WIDTH - dx) w = WIDTH - dx;
+    if(h > HEIGHT - sy) h = HEIGHT - sy;
+    if(h > HEIGHT - dy) h = HEIGHT - dy;
+    if(w <= 0 || h <= 0)
+        return;
+
+#ifdef PxMATRIX_SHADOW_BUFFER
+    // Rows of the shadow buffer are continuous
+    for(int16_t j = 0; j < h; ++j) {
+        int16_t row = (dy > sy) ? (h - 1 - j) : j;
+        uint16_t y = dy + row;
+        memmove(PxMATRIX_shadow_buffer + (uint32_t)y * WIDTH + dx,
+                PxMATRIX_shadow_buffer + (uint32_t)(sy + row) * WIDTH + sx, w);
+        for(uint8_t i = 0; i < PxMATRIX_BUFFER_COUNT; ++i)
+            _shadow_dirty[i * ((HEIGHT + 7) / 8) + y / 8] |= _BV(y % 8);
+    }
+    return;
+#endif
+    if(_flip)
+        copyRect<true>(src_buffer, sx, sy, w, h, dst_buffer, dx, dy);
+    else
+        copyRect<false>(src_buffer, sx, sy, w, h, dst_buffer, dx, dy);
+}
+
+template<bool FLIP>
+inline void PxMATRIX::copyRect(PxMATRIX::Buffer_Type src_buffer, int16_t sx, int16_t sy, int16_t w, int16_t h,
+                               PxMATRIX::Buffer_Type dst_buffer, int16_t dx, int16_t dy) {
+    const uint8_t* pSrc = getBuffer(src_buffer);
+    const uint8_t* pSrcLit = getLitPlanes(src_buffer);
+    uint8_t* pDst = getBuffer(dst_buffer);
+    uint8_t* pDstLit = getLitPlanes(dst_buffer);
+
+    // Overlapped rectangle is copied from the side it moves to, so source pixels are read before they are overwritten
+    const bool reverse_rows = (pSrc == pDst) && (dy > sy);
+    const bool reverse_bytes = (pSrc == pDst) && (dx > sx);
+
+    // Bytes of a row are not continuous (scan lines are interleaved, see mapBufferIndex),
+    // so each 8 pixels of the destination are composed from two source bytes
+    const int16_t first = dx / 8;
+    const int16_t last = (dx + w - 1) / 8;
+    uint16_t src_byte[2];
+    uint8_t  src_bit[2];
+    uint8_t  src_line[2];
+    uint8_t  dst_bit = 0;
+    uint8_t  dst_line = 0;
+    for(int16_t j = 0; j < h; ++j) {
+        int16_t row = reverse_rows ? (h - 1 - j) : j;
+        for(int16_t k = 0; k <= last - first; ++k) {
+            int16_t x = (reverse_bytes ? (last - k) : (first + k)) * 8;
+            uint16_t dst_byte = mapBufferIndex<false, FLIP>(x, dy + row, &dst_bit, &dst_line);
+
+            // Pixels of the rectangle in the destination byte (bit n is pixel x + n)
+            int16_t from = (dx > x) ? (dx - x) : 0;
+            int16_t to = (dx + w < x + 8) ? (dx + w - x) : 8;
+            uint8_t mask = (uint8_t)(0xFF >> (8 - (to - from))) << from;
+
+            // Source pixels start in the byte at src_x with the offset
+            int16_t src_x = x + sx - dx;
+            int16_t offset = (src_x + 8) % 8;
+            src_x -= offset;
+            uint8_t lit = 0;
+            for(uint8_t n = 0; n < 2; ++n) {
+                src_byte[n] = BUFFER_OUT_OF_BOUNDS;
+                if(n == 0 || offset != 0)
+                    src_byte[n] = mapBufferIndex<false, FLIP>(src_x + n * 8, sy + row, &src_bit[n], &src_line[n]);
+                if(src_byte[n] != BUFFER_OUT_OF_BOUNDS)
+                    lit |= pSrcLit[src_line[n]];
+            }
+            pDstLit[dst_line] |= lit;
+
+            if(offset == 0 && src_bit[0] == dst_bit) {
+                // Aligned bytes with the same bit order
+                uint8_t dst_mask = (dst_bit != 0) ? reverseBits(mask) : mask;
+                for(uint8_t i = 0; i < PxMATRIX_BUFFER_PLANES; ++i) {
+                    uint8_t* pByte = &pDst[i * _buffer_size + dst_byte];
+                    *pByte = (*pByte & ~dst_mask) | (pSrc[i * _buffer_size + src_byte[0]] & dst_mask);
+                }
+                continue;
+            }
+            for(uint8_t i = 0; i < PxMATRIX_BUFFER_PLANES; ++i) {
+                uint16_t bits = 0;
+                for(uint8_t n = 0; n < 2; ++n) {
+                    if(src_byte[n] == BUFFER_OUT_OF_BOUNDS)
+                        continue;
+                    uint8_t value = pSrc[i * _buffer_size + src_byte[n]];
+                    bits |= (uint16_t)((src_bit[n] != 0) ? reverseBits(value) : value) << (n * 8);
+                }
+                uint8_t value = (uint8_t)(bits >> offset);
+                uint8_t* pByte = &pDst[i * _buffer_size + dst_byte];
+                if(dst_bit != 0)
+                    *pByte = (*pByte & ~reverseBits(mask)) | reverseBits(value & mask);
+                else
+                    *pByte = (*pByte & ~mask) | (value & mask);
+            }
+        }
+    }
+}
+
+#ifdef PxMATRIX_SHADOW_BUFFER
+inline uint8_t* PxMATRIX::getShadowDirty(PxMATRIX::Buffer_Type selected_buffer) {
+    return _shadow_dirty + ((getBuffer(selected_buffer) == PxMATRIX_buffer) ? 0 : (HEIGHT + 7) / 8);
+}
+
+inline uint32_t PxMATRIX::mapShadowIndex(int16_t x, int16_t y) {
     if(_rotate) {
         int16_t temp_x = x;
         x = y;
         y = (HEIGHT - 1) - temp_x;
     }
+    if(x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT)
+        return SHADOW_OUT_OF_BOUNDS;
+    return (uint32_t)y * WIDTH + x;
+}
+
+inline void PxMATRIX::fillShadowBuffer(int16_t x, int16_t y, uint8_t r) {
+    uint32_t index = mapShadowIndex(x, y);
+    if(index == SHADOW_OUT_OF_BOUNDS)
+        return;
+    PxMATRIX_shadow_buffer[index] = r;
+    // Row should be encoded into all buffers
+    uint16_t row = index / WIDTH;
+    for(uint8_t i = 0; i < PxMATRIX_BUFFER_COUNT; ++i)
+        _shadow_dirty[i * ((HEIGHT + 7) / 8) + row / 8] |= _BV(row % 8);
+}
+
+inline void PxMATRIX::encodeShadow() {
+    if(_flip)
+        encodeShadow<true>();
+    else
+        encodeShadow<false>();
+}
+
+template<bool FLIP>
+inline void PxMATRIX::encodeShadow() {
+    uint8_t* pBuffer = getBuffer(PxMATRIX::Buffer_Type::INACTIVE);
+    uint8_t* pLitPlanes = getLitPlanes(PxMATRIX::Buffer_Type::INACTIVE);
+    uint8_t* pDirty = getShadowDirty(PxMATRIX::Buffer_Type::INACTIVE);
+    uint8_t  nbit = 0;
+    uint8_t  nline = 0;
+    for(int16_t y = 0; y < HEIGHT; ++y) {
+        if(!(pDirty[y / 8] & _BV(y % 8)))
+            continue;
+        pDirty[y / 8] &= ~_BV(y % 8);
+
+        const uint8_t* pRow = PxMATRIX_shadow_buffer + (uint32_t)y * WIDTH;
+        for(int16_t x = 0; x < WIDTH; x += 8) {
+            uint16_t nbyte = mapBufferIndex<false, FLIP>(x, y, &nbit, &nline);
+            if(nbyte == BUFFER_OUT_OF_BOUNDS)
+                continue;
+
+            // Levels of 8 pixels in order of the register bits (from the highest bit)
+            uint8_t level[8];
+            uint8_t lit = 0;
+            for(uint8_t j = 0; j < 8; ++j) {
+                uint8_t value = mapColorLevel(pRow[x + ((nbit != 0) ? j : 7 - j)]);
+                level[j] = value;
+                lit |= value ^ PxMATRIX_DATA_CLEAR;
+            }
+            pLitPlanes[nline] |= lit & PxMATRIX_PLANES_MASK;
+
+            // Transpose 8x8 bit matrix so each byte holds a bit plane
+            // (Hacker's Delight, 7-3 "Transposing a bit matrix")
+            uint32_t hi = ((uint32_t)level[0] << 24) | ((uint32_t)level[1] << 16) | ((uint32_t)level[2] << 8) | level[3];
+            uint32_t lo = ((uint32_t)level[4] << 24) | ((uint32_t)level[5] << 16) | ((uint32_t)level[6] << 8) | level[7];
+            uint32_t t = 0;
+            t = (hi ^ (hi >> 7)) & 0x00AA00AA;  hi = hi ^ t ^ (t << 7);
+            t = (lo ^ (lo >> 7)) & 0x00AA00AA;  lo = lo ^ t ^ (t << 7);
+            t = (hi ^ (hi >> 14)) & 0x0000CCCC; hi = hi ^ t ^ (t << 14);
+            t = (lo ^ (lo >> 14)) & 0x0000CCCC; lo = lo ^ t ^ (t << 14);
+            t = (hi & 0xF0F0F0F0) | ((lo >> 4) & 0x0F0F0F0F);
+            lo = ((hi << 4) & 0xF0F0F0F0) | (lo & 0x0F0F0F0F);
+            hi = t;
+            // Byte k of the result (from the highest) is the bit plane (7 - k)
+            const uint8_t planes[8] = {
+                (uint8_t)lo, (uint8_t)(lo >> 8), (uint8_t)(lo >> 16), (uint8_t)(lo >> 24),
+                (uint8_t)hi, (uint8_t)(hi >> 8), (uint8_t)(hi >> 16), (uint8_t)(hi >> 24)
+            };
+            for(uint8_t i = 0; i < PxMATRIX_BUFFER_PLANES; ++i)
+                pBuffer[i * _buffer_size + nbyte] = planes[i];
+        }
+    }
+}
+#endif /* PxMATRIX_SHADOW_BUFFER */
+
+inline uint16_t PxMATRIX::mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit, uint8_t* pLine) {
+    if(_rotate)
+        return _flip ? mapBufferIndex<true, true>(x, y, pBit, pLine) : mapBufferIndex<true, false>(x, y, pBit, pLine);
+    return _flip ? mapBufferIndex<false, true>(x, y, pBit, pLine) : mapBufferIndex<false, false>(x, y, pBit, pLine);
+}
+
+template<bool ROTATE, bool FLIP>
+inline uint16_t PxMATRIX::mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit, uint8_t* pLine) {
+    if(ROTATE) {
+        int16_t temp_x = x;
+        x = y;
+        y = (HEIGHT - 1) - temp_x;
+    }
     // Panels are naturally flipped horizontally
-    if(!_flip) {
+    if(!FLIP) {
         x = (WIDTH - 1) - x;
     }
     if(x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT)
@@ -213,6 +531,8 @@ inline uint16_t PxMATRIX::mapBufferIndex(int16_t x, int16_t y, uint8_t* pBit) {
     } else {
       offset += _panel_width_bytes * panel_index;
     }
+    if(pLine != nullptr)
+        *pLine = row_index;
     return _row_offset[row_index] - offset;
 }
 
@@ -224,12 +544,19 @@ inline uint8_t PxMATRIX::mapColorLevel(uint8_t r) {
 #ifdef PxMATRIX_DATA_INVERT
     r = 255 - r;
 #endif
-    uint8_t level = r >> (8 - PxMATRIX_COLOR_DEPTH);
+    uint8_t level = r >> (8 - PxMATRIX_BUFFER_PLANES);
+#if PxMATRIX_DITHER_BITS > 0
+    // Displayed bits go first then the dithering bits
+    level = (level >> PxMATRIX_DITHER_BITS) | ((level & (_BV(PxMATRIX_DITHER_BITS) - 1)) << PxMATRIX_COLOR_DEPTH);
+#endif
     return level;
 }
 
 inline uint8_t PxMATRIX::unmapColorLevel(uint8_t level) {
-    uint8_t r = level << (8 - PxMATRIX_COLOR_DEPTH);
+#if PxMATRIX_DITHER_BITS > 0
+    level = ((level & (_BV(PxMATRIX_COLOR_DEPTH) - 1)) << PxMATRIX_DITHER_BITS) | (level >> PxMATRIX_COLOR_DEPTH);
+#endif
+    uint8_t r = level << (8 - PxMATRIX_BUFFER_PLANES);
 #ifdef PxMATRIX_DATA_INVERT
     r = 255 - r;
 #endif
@@ -246,15 +573,19 @@ inline uint8_t PxMATRIX::unmapColorLevel(uint8_t level) {
 
 inline void PxMATRIX::fillMatrixBuffer(int16_t x, int16_t y, uint8_t r, PxMATRIX::Buffer_Type selected_buffer) {
     uint8_t  nbit = 0;
-    uint32_t nbyte = mapBufferIndex(x, y, &nbit);
+    uint8_t  nline = 0;
+    uint32_t nbyte = mapBufferIndex(x, y, &nbit, &nline);
     if(nbyte == BUFFER_OUT_OF_BOUNDS)
         return;
 
     uint8_t level = mapColorLevel(r);
+    getLitPlanes(selected_buffer)[nline] |= (level ^ PxMATRIX_DATA_CLEAR) & PxMATRIX_PLANES_MASK;
+    storeLevel(getBuffer(selected_buffer), nbyte, nbit, level);
+}
 
+inline void PxMATRIX::storeLevel(uint8_t* pBuffer, uint16_t nbyte, uint8_t nbit, uint8_t level) {
     // Store pixel level bits separatelly into bit planes
-    uint8_t* pBuffer = getBuffer(selected_buffer);
-    for(uint8_t i = 0; i < PxMATRIX_COLOR_DEPTH; ++i) {
+    for(uint8_t i = 0; i < PxMATRIX_BUFFER_PLANES; ++i) {
         if(level & _BV(i)) {
             pBuffer[i * _buffer_size + nbyte] |= _BV(nbit);
         } else {
@@ -263,7 +594,96 @@ inline void PxMATRIX::fillMatrixBuffer(int16_t x, int16_t y, uint8_t r, PxMATRIX
     }
 }
 
+inline void PxMATRIX::startWrite() {
+    if(_write_depth++ > 0)
+        return;
+    _write_buffer = getBuffer(PxMATRIX::Buffer_Type::INACTIVE);
+    _write_lit_planes = getLitPlanes(PxMATRIX::Buffer_Type::INACTIVE);
+    _write_color = 0;
+    _write_level = mapColorLevel(0);
+}
+
+inline void PxMATRIX::endWrite() {
+    if(_write_depth > 0 && --_write_depth == 0) {
+        _write_buffer = nullptr;
+        _write_lit_planes = nullptr;
+    }
+}
+
+inline void PxMATRIX::writePixel(int16_t x, int16_t y, uint16_t color) {
+#ifdef PxMATRIX_SHADOW_BUFFER
+    fillShadowBuffer(x, y, color & 0xFF);
+    return;
+#endif
+    if(_write_buffer == nullptr) {
+        drawPixel(x, y, color);
+        return;
+    }
+    uint8_t  nbit = 0;
+    uint8_t  nline = 0;
+    uint16_t nbyte = mapBufferIndex(x, y, &nbit, &nline);
+    if(nbyte == BUFFER_OUT_OF_BOUNDS)
+        return;
+    // Drawing primitives use the same color for many pixels
+    uint8_t r = color & 0xFF;
+    if(r != _write_color) {
+        _write_color = r;
+        _write_level = mapColorLevel(r);
+    }
+    _write_lit_planes[nline] |= (_write_level ^ PxMATRIX_DATA_CLEAR) & PxMATRIX_PLANES_MASK;
+    storeLevel(_write_buffer, nbyte, nbit, _write_level);
+}
+
+inline void PxMATRIX::drawPixels(const PxMATRIX::Point* points, uint16_t count, uint16_t color) {
+    drawPixels(points, nullptr, count, color & 0xFF);
+}
+
+inline void PxMATRIX::drawPixels(const PxMATRIX::Point* points, const uint8_t* colors, uint16_t count) {
+    drawPixels(points, colors, count, 0);
+}
+
+inline void PxMATRIX::drawPixels(const PxMATRIX::Point* points, const uint8_t* colors, uint16_t count, uint8_t color) {
+#ifdef PxMATRIX_SHADOW_BUFFER
+    for(uint16_t i = 0; i < count; ++i)
+        fillShadowBuffer(points[i].x, points[i].y, (colors != nullptr) ? colors[i] : color);
+    return;
+#endif
+    if(_rotate) {
+        if(_flip) drawPixels<true, true>(points, colors, count, color);
+        else      drawPixels<true, false>(points, colors, count, color);
+    } else {
+        if(_flip) drawPixels<false, true>(points, colors, count, color);
+        else      drawPixels<false, false>(points, colors, count, color);
+    }
+}
+
+template<bool ROTATE, bool FLIP>
+inline void PxMATRIX::drawPixels(const PxMATRIX::Point* points, const uint8_t* colors, uint16_t count, uint8_t color) {
+    uint8_t* pBuffer = getBuffer(PxMATRIX::Buffer_Type::INACTIVE);
+    uint8_t* pLitPlanes = getLitPlanes(PxMATRIX::Buffer_Type::INACTIVE);
+    uint8_t  level = mapColorLevel(color);
+    uint8_t  lit = (level ^ PxMATRIX_DATA_CLEAR) & PxMATRIX_PLANES_MASK;
+    uint8_t  nbit = 0;
+    uint8_t  nline = 0;
+    for(uint16_t i = 0; i < count; ++i) {
+        uint16_t nbyte = mapBufferIndex<ROTATE, FLIP>(points[i].x, points[i].y, &nbit, &nline);
+        if(nbyte == BUFFER_OUT_OF_BOUNDS)
+            continue;
+        if(colors != nullptr && colors[i] != color) {
+            color = colors[i];
+            level = mapColorLevel(color);
+            lit = (level ^ PxMATRIX_DATA_CLEAR) & PxMATRIX_PLANES_MASK;
+        }
+        pLitPlanes[nline] |= lit;
+        storeLevel(pBuffer, nbyte, nbit, level);
+    }
+}
+
 inline uint8_t PxMATRIX::getPixel(int16_t x, int16_t y, PxMATRIX::Buffer_Type selected_buffer) {
+#ifdef PxMATRIX_SHADOW_BUFFER
+    uint32_t index = mapShadowIndex(x, y);
+    return (index == SHADOW_OUT_OF_BOUNDS) ? 0 : PxMATRIX_shadow_buffer[index];
+#endif
     uint8_t  nbit = 0;
     uint32_t nbyte = mapBufferIndex(x, y, &nbit);
     if(nbyte == BUFFER_OUT_OF_BOUNDS)
@@ -272,7 +692,7 @@ inline uint8_t PxMATRIX::getPixel(int16_t x, int16_t y, PxMATRIX::Buffer_Type se
     // Restore pixel level from bit planes
     uint8_t* pBuffer = getBuffer(selected_buffer);
     uint8_t  level = 0;
-    for(uint8_t i = 0; i < PxMATRIX_COLOR_DEPTH; ++i) {
+    for(uint8_t i = 0; i < PxMATRIX_BUFFER_PLANES; ++i) {
         if(pBuffer[i * _buffer_size + nbyte] & _BV(nbit))
             level |= _BV(i);
     }
@@ -281,6 +701,140 @@ inline uint8_t PxMATRIX::getPixel(int16_t x, int16_t y, PxMATRIX::Buffer_Type se
     return r;
 }
 
+inline uint16_t PxMATRIX::getRowWidth() const {
+    return _rotate ? HEIGHT : WIDTH;
+}
+
+inline uint8_t PxMATRIX::getRowWords() const {
+    return (getRowWidth() + 31) / 32;
+}
+
+inline uint8_t PxMATRIX::reverseBits(uint8_t bits) {
+    static const uint8_t nibble[16] = { 0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF };
+    return (nibble[bits & 0x0F] << 4) | nibble[bits >> 4];
+}
+
+inline void PxMATRIX::readRow(int16_t y, uint32_t* row, uint8_t plane, PxMATRIX::Buffer_Type selected_buffer) {
+    const uint16_t width = getRowWidth();
+    memset(row, 0, getRowWords() * sizeof(uint32_t));
+
+    const uint8_t* pPlane = getBuffer(selected_buffer) + plane * _buffer_size;
+    uint8_t  nbit = 0;
+    uint16_t nbyte = 0;
+    if(!_rotate) {
+        // Each 8 pixels of the row are bits of a single byte (in direct or reverse order)
+        for(uint16_t x = 0; x < width; x += 8) {
+            nbyte = mapBufferIndex(x, y, &nbit);
+            if(nbyte == BUFFER_OUT_OF_BOUNDS)
+                return;
+            uint8_t bits = pPlane[nbyte] ^ PxMATRIX_DATA_CLEAR;
+            if(nbit != 0)
+                bits = reverseBits(bits);
+            row[x / 32] |= (uint32_t)bits << (x % 32);
+        }
+    } else {
+        for(uint16_t x = 0; x < width; ++x) {
+            nbyte = mapBufferIndex(x, y, &nbit);
+            if(nbyte == BUFFER_OUT_OF_BOUNDS)
+                return;
+            if((pPlane[nbyte] ^ PxMATRIX_DATA_CLEAR) & _BV(nbit))
+                row[x / 32] |= (uint32_t)1 << (x % 32);
+        }
+    }
+}
+
+inline void PxMATRIX::writeRow(int16_t y, const uint32_t* row, uint8_t plane, PxMATRIX::Buffer_Type selected_buffer) {
+    const uint16_t width = getRowWidth();
+
+    // Bit masks of each plane for lit and black pixels
+    uint8_t first = 0;
+    uint8_t last = PxMATRIX_BUFFER_PLANES - 1;
+    uint8_t lit = mapColorLevel(0xFF);
+    uint8_t black = mapColorLevel(0);
+    if(plane != PLANES_ALL) {
+        first = last = plane;
+        lit = (uint8_t)~PxMATRIX_DATA_CLEAR;
+        black = PxMATRIX_DATA_CLEAR;
+    }
+
+    // Bit planes to mark for lit and black pixels
+    uint8_t planes = (_BV(last + 1) - 1) & ~(_BV(first) - 1);
+    uint8_t lit_planes = (lit ^ PxMATRIX_DATA_CLEAR) & planes;
+    uint8_t black_planes = (black ^ PxMATRIX_DATA_CLEAR) & planes;
+
+    uint8_t* pBuffer = getBuffer(selected_buffer);
+    uint8_t* pLitPlanes = getLitPlanes(selected_buffer);
+    uint8_t  nbit = 0;
+    uint8_t  nline = 0;
+    uint16_t nbyte = 0;
+    if(!_rotate) {
+        for(uint16_t x = 0; x < width; x += 8) {
+            nbyte = mapBufferIndex(x, y, &nbit, &nline);
+            if(nbyte == BUFFER_OUT_OF_BOUNDS)
+                return;
+            uint8_t bits = row[x / 32] >> (x % 32);
+            if(nbit != 0)
+                bits = reverseBits(bits);
+            if(bits != 0x00)
+                pLitPlanes[nline] |= lit_planes;
+            if(bits != 0xFF)
+                pLitPlanes[nline] |= black_planes;
+            for(uint8_t i = first; i <= last; ++i) {
+                uint8_t lit_bits = (lit & _BV(i)) ? 0xFF : 0x00;
+                uint8_t black_bits = (black & _BV(i)) ? 0xFF : 0x00;
+                pBuffer[i * _buffer_size + nbyte] = (bits & lit_bits) | (~bits & black_bits);
+            }
+        }
+    } else {
+        for(uint16_t x = 0; x < width; ++x) {
+            nbyte = mapBufferIndex(x, y, &nbit, &nline);
+            if(nbyte == BUFFER_OUT_OF_BOUNDS)
+                return;
+            bool is_lit = row[x / 32] & ((uint32_t)1 << (x % 32));
+            uint8_t level = is_lit ? lit : black;
+            pLitPlanes[nline] |= is_lit ? lit_planes : black_planes;
+            for(uint8_t i = first; i <= last; ++i) {
+                if(level & _BV(i)) {
+                    pBuffer[i * _buffer_size + nbyte] |= _BV(nbit);
+                } else {
+                    pBuffer[i * _buffer_size + nbyte] &= ~_BV(nbit);
+                }
+            }
+        }
+    }
+}
+
+inline void PxMATRIX::rotateRow(uint32_t* dst, const uint32_t* src, uint16_t width, int8_t dir) {
+    const uint8_t words = (width + 31) / 32;
+    const uint8_t last_bit = (width - 1) % 32;
+    if(dir > 0) {
+        uint32_t carry = (src[words - 1] >> last_bit) & 1;
+        for(uint8_t i = 0; i < words; ++i) {
+            uint32_t next_carry = src[i] >> 31;
+            dst[i] = (src[i] << 1) | carry;
+            carry = next_carry;
+        }
+    } else {
+        uint32_t carry = src[0] & 1;
+        for(uint8_t i = 0; i < words; ++i) {
+            uint32_t next = (i + 1 < words) ? src[i + 1] << 31 : 0;
+            dst[i] = (src[i] >> 1) | next;
+        }
+        dst[words - 1] = (dst[words - 1] & ~((uint32_t)1 << last_bit)) | (carry << last_bit);
+    }
+    // Clear bits outside of the row
+    if(last_bit != 31)
+        dst[words - 1] &= ((uint32_t)2 << last_bit) - 1;
+}
+
+inline uint16_t PxMATRIX::countRow(const uint32_t* row, uint16_t width) {
+    const uint8_t words = (width + 31) / 32;
+    uint16_t count = 0;
+    for(uint8_t i = 0; i < words; ++i)
+        count += __builtin_popcountl(row[i]);
+    return count;
+}
+
 void PxMATRIX::spi_init() {
     SPI.begin();
 
@@ -292,7 +846,7 @@ void PxMATRIX::spi_init() {
     SPI.setBitOrder(MSBFIRST);
 }
 
-void PxMATRIX::begin(uint8_t row_pattern) {
+bool PxMATRIX::begin(uint8_t row_pattern, uint8_t* storage, uint16_t storage_size) {
     _row_pattern = row_pattern;
     _rows_per_pattern = _panel_height / _row_pattern;
     uint8_t _pattern_color_bytes = WIDTH / 8;
@@ -319,15 +873,108 @@ void PxMATRIX::begin(uint8_t row_pattern) {
         digitalWrite(pin, LOW);
     }
 
+    return initRows(storage, storage_size);
+}
+
+void PxMATRIX::begin(uint8_t row_pattern) {
+    begin(row_pattern, nullptr, 0);
+}
+
+bool PxMATRIX::initRows(uint8_t* storage, uint16_t storage_size) {
+    const uint16_t count = _row_pattern * _LATCH_PINS.size;
+    const uint16_t memory_size = getRowsMemorySize(_row_pattern, _LATCH_PINS.size);
+    const bool use_storage = (storage != nullptr && storage_size >= memory_size);
+
+    // Release tables of the previous scan pattern
+    if(_own_rows)
+        delete[] _rows_memory;
+    _own_rows = !use_storage;
+    if(_own_rows)
+        storage = new uint8_t[memory_size];
+    _rows_memory = storage;
+
+#if defined(ESP8266) || defined(ESP32)
+    // Align tables
+    const uintptr_t align = alignof(Mux_Mask) - 1;
+    storage += (align + 1 - (reinterpret_cast<uintptr_t>(storage) & align)) & align;
+    _mux_masks = reinterpret_cast<Mux_Mask*>(storage);
+    storage += _row_pattern * sizeof(Mux_Mask);
+#endif
+
     // Precompute row offset values (the last byte of pattern plane)
-    _row_offset = new uint16_t[_row_pattern * _LATCH_PINS.size];
+    _row_offset = reinterpret_cast<uint16_t*>(storage);
     for(uint8_t line = 0; line < _LATCH_PINS.size; ++line)
         for(uint8_t row = 0; row < _row_pattern; ++row) {
             _row_offset[_row_pattern * line + row] = _send_buffer_size * (_row_pattern * line + row) + (_send_buffer_size - 1);
         }
+    storage += count * sizeof(uint16_t);
+
+    // Buffers are cleared later, so consider all scan lines could be lit
+    _lit_planes = storage;
+    memset(_lit_planes, PxMATRIX_PLANES_MASK, count);
+#ifdef PxMATRIX_DOUBLE_BUFFER
+    _lit_planes2 = storage + count;
+    memset(_lit_planes2, PxMATRIX_PLANES_MASK, count);
+#endif
+    _blank_lines = 0;
+
+    compileProgram(PxMATRIX_DEFAULT_SHOWTIME);
+    return use_storage || storage_size == 0;
 }
 
+void PxMATRIX::compileProgram(uint16_t show_time) {
+    // Mux pins can be set at once by GPIO registers (if there are no delays)
+    _program_gpio = false;
+#if defined(ESP8266) || defined(ESP32)
+    _program_gpio = _mux_masks != nullptr && !(_mux_delay_A || _mux_delay_B || _mux_delay_C || _mux_delay_D || _mux_delay_E);
+    // GPIO registers reach GPIO0-15 on ESP8266 (GPIO16 is in RTC block) and GPIO0-31 on ESP32
+#ifdef ESP8266
+    const uint8_t gpio_pins = 16;
+#else
+    const uint8_t gpio_pins = 32;
+#endif
+    for(uint8_t i = 0; i < _MUX_PINS.size; ++i)
+        if(_MUX_PINS[i] >= gpio_pins)
+            _program_gpio = false;
+#endif
+
+    for(uint8_t color = 0; color < PxMATRIX_COLOR_DEPTH; ++color)
+        _plane_time[color] = getLatchTime(show_time, color);
+#if defined(ESP8266) || defined(ESP32)
+    for(uint8_t row = 0; row < _row_pattern && _program_gpio; ++row) {
+        _mux_masks[row].set = 0;
+        _mux_masks[row].clear = 0;
+        for(uint8_t i = 0; i < _MUX_PINS.size; ++i) {
+            if(_row_pattern < _BV(i)) break;
+            if(row & _BV(i))
+                _mux_masks[row].set |= 1UL << _MUX_PINS[i];
+            else
+                _mux_masks[row].clear |= 1UL << _MUX_PINS[i];
+        }
+    }
+#endif
+    _program_show_time = show_time;
+    _program_brightness = _brightness;
+}
+
+inline uint16_t PxMATRIX::getPlaneTime(uint8_t plane) const {
+    return _plane_time[plane];
+}
+
+#if defined(ESP8266) || defined(ESP32)
+inline const PxMATRIX::Mux_Mask* PxMATRIX::getMuxMasks() const {
+    return _program_gpio ? _mux_masks : nullptr;
+}
+#endif
+
 void PxMATRIX::set_mux(uint8_t value) {
+#if defined(ESP8266) || defined(ESP32)
+    if(_program_gpio) {
+        GPIO_REG_SET(_mux_masks[value].set);
+        GPIO_REG_CLEAR(_mux_masks[value].clear);
+        return;
+    }
+#endif
     for(uint8_t i = 0; i < _MUX_PINS.size; ++i) {
         if(_row_pattern < _BV(i)) break;
         digitalWrite(_MUX_PINS[i], (value & _BV(i)) ? HIGH : LOW);
@@ -341,12 +988,15 @@ void PxMATRIX::set_mux(uint8_t value) {
 
 void PxMATRIX::latch(uint16_t show_time, uint8_t latch_index) {
     if(latch_index == LATCH_ALL) {
+        _blank_lines = 0;
         for(uint8_t i = 0; i < _LATCH_PINS.size; ++i) {
             uint8_t pin = _LATCH_PINS[i];
             digitalWrite(pin, HIGH ^ PxMATRIX_LATCH_INVERT);
             digitalWrite(pin, LOW ^ PxMATRIX_LATCH_INVERT);
         }
     } else if(latch_index != LATCH_NONE) {
+        if(latch_index < 16)
+            _blank_lines &= ~_BV(latch_index);
         digitalWrite(_LATCH_PINS[latch_index], HIGH ^ PxMATRIX_LATCH_INVERT);
         digitalWrite(_LATCH_PINS[latch_index], LOW ^ PxMATRIX_LATCH_INVERT);
     }
@@ -359,19 +1009,19 @@ void PxMATRIX::latch(uint16_t show_time, uint8_t latch_index) {
     }
 }
 
-uint16_t PxMATRIX::getLatchTime(uint16_t show_time) {
+uint16_t PxMATRIX::getLatchTime(uint16_t show_time, uint8_t color) {
 #if PxMATRIX_COLOR_DEPTH == 1
     return (show_time * _brightness) / 255;
 #else
     // Display bit planes in Bit Angle Modulation
     // Thus show_time is a total time to show all bit planes
 #ifndef __AVR__
-    return ((show_time * (1 << _display_color) * _brightness) / 255 / 2);
+    return ((show_time * (1 << color) * _brightness) / 255 / 2);
 #else
     // AVR8 archtecture has 16-bit integer so overflow may occure
     if(show_time >= (65535U >> (PxMATRIX_COLOR_DEPTH - 1)))
         show_time = (65535U >> (PxMATRIX_COLOR_DEPTH - 1));
-    uint16_t latch_time = show_time * (1 << _display_color);
+    uint16_t latch_time = show_time * (1 << color);
     if(latch_time > 512) {
         return (latch_time / 255) * _brightness / 2;
     } else if(latch_time > 256) {
@@ -383,68 +1033,361 @@ uint16_t PxMATRIX::getLatchTime(uint16_t show_time) {
 #endif /* PxMATRIX_COLOR_DEPTH */
 }
 
-void PxMATRIX::display(uint16_t show_time) {
+PxMATRIX::Refresh_Timing PxMATRIX::measureRefresh(uint8_t repeats) {
+    Refresh_Timing timing;
+    uint8_t* pBuffer = getBuffer(PxMATRIX::Buffer_Type::ACTIVE);
+    unsigned long start_time = 0;
+
+    // Data is latched while outputs are disabled, so nothing is displayed
+    start_time = micros();
+    for(uint8_t i = 0; i < repeats; ++i) {
+        SPI_BUFFER(pBuffer, _send_buffer_size);
+        latch(0, 0);
+    }
+    timing.spi_time = (micros() - start_time) / repeats;
+
+    start_time = micros();
+    // Mux is selected the same way as by display method (see compileProgram)
+    for(uint8_t i = 0; i < repeats; ++i)
+        set_mux(i % _row_pattern);
+    timing.mux_time = (micros() - start_time) / repeats;
+
+    // Display call of the first bit plane with the shortest show time.
+    // All scan lines are sent (as for the content with lit pixels in every scan line)
+    uint8_t display_color = _display_color;
+    _scan_full = true;
+    uint16_t latch_time = getLatchTime(1, 0);
+    uint32_t call_time = 0;
+    for(uint8_t i = 0; i < repeats; ++i) {
+        _display_color = 0;
+        start_time = micros();
+        display(1);
+        call_time += micros() - start_time;
+    }
+    _display_color = display_color;
+    _scan_full = false;
+    _blank_lines = 0; // Registers hold the sent data
+    call_time /= repeats;
+    uint32_t rows_time = (uint32_t)_row_pattern * (timing.mux_time + _LATCH_PINS.size * timing.spi_time + latch_time);
+    timing.call_time = (call_time > rows_time) ? (call_time - rows_time) : 0;
+    return timing;
+}
+
+bool PxMATRIX::calibrateRefresh(const PxMATRIX::Refresh_Timing& timing, uint16_t refresh_rate, uint8_t row_pattern, uint8_t lines,
+                                PxMATRIX::Refresh_Settings& settings, uint8_t max_load) {
+    return PxMATRIX_calibrateRefresh(timing, refresh_rate, PxMATRIX_COLOR_DEPTH, row_pattern, lines, settings, max_load);
+}
+
+bool PxMATRIX::calibrateRefresh(uint16_t refresh_rate, PxMATRIX::Refresh_Settings& settings, uint8_t max_load) {
+    Refresh_Timing timing = measureRefresh();
+    return calibrateRefresh(timing, refresh_rate, _row_pattern, _LATCH_PINS.size, settings, max_load);
+}
+
+#ifdef ESP32
+bool PxMATRIX::startRefresh(uint16_t refresh_rate, uint8_t core, uint8_t max_load) {
+    stopRefresh();
+    if(refreshInstance() != nullptr)
+        return false; // Other display is refreshed by the task
+
+    Refresh_Settings settings;
+    if(!calibrateRefresh(refresh_rate, settings, max_load))
+        return false;
+    _refresh_show_time = settings.show_time;
+    _refresh_period = settings.timer_period;
+    getRefreshStats(true);
+
+    refreshInstance() = this;
+    _refresh_run = true;
+    if(xTaskCreatePinnedToCore(&refresh_task, "PxMATRIX", 4096, this, configMAX_PRIORITIES - 1,
+                               (TaskHandle_t*)&_refresh_task, core) != pdPASS) {
+        _refresh_task = nullptr;
+        _refresh_run = false;
+        refreshInstance() = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void PxMATRIX::stopRefresh() {
+    if(refreshInstance() != this)
+        return;
+    _refresh_run = false;
+    // The task stops its timer and exits after the current display call
+    while(_refresh_task != nullptr)
+        delay(1);
+    refreshInstance() = nullptr;
+}
+
+PxMATRIX::Refresh_Stats PxMATRIX::getRefreshStats(bool reset) {
+    portENTER_CRITICAL(&_refresh_mux);
+    Refresh_Stats stats = _refresh_stats;
+    if(stats.calls > 0)
+        stats.avg_jitter = (uint16_t)(_refresh_jitter_sum / stats.calls);
+    if(reset) {
+        _refresh_stats = Refresh_Stats{};
+        _refresh_jitter_sum = 0;
+    }
+    portEXIT_CRITICAL(&_refresh_mux);
+    return stats;
+}
+
+void IRAM_ATTR PxMATRIX::on_refresh_timer() {
+    PxMATRIX* display = refreshInstance();
+    if(display == nullptr || display->_refresh_task == nullptr)
+        return;
+    display->_refresh_tick = micros();
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(display->_refresh_task, &woken);
+    if(woken == pdTRUE)
+        portYIELD_FROM_ISR();
+}
+
+void PxMATRIX::refresh_task(void* arg) {
+    PxMATRIX* display = (PxMATRIX*)arg;
+    // Timer is started by the task, so its interruption is handled by the same core
+#if ESP_ARDUINO_VERSION_MAJOR <= 2
+    hw_timer_t* timer = timerBegin(1, 80, true);
+    timerAttachInterrupt(timer, &on_refresh_timer, true);
+    timerAlarmWrite(timer, display->_refresh_period, true);
+    timerAlarmEnable(timer);
+#else
+    hw_timer_t* timer = timerBegin(1000000);
+    timerAttachInterrupt(timer, &on_refresh_timer);
+    timerAlarm(timer, display->_refresh_period, true, 0);
+#endif
+
+    while(display->_refresh_run) {
+        // Number of timer ticks since the last call (more than one if the task was late)
+        uint32_t ticks = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        if(ticks == 0)
+            continue;
+        unsigned long start_time = micros();
+        uint32_t jitter = start_time - display->_refresh_tick;
+        display->display(display->_refresh_show_time);
+        uint32_t busy = micros() - start_time;
+
+        portENTER_CRITICAL(&display->_refresh_mux);
+        Refresh_Stats& stats = display->_refresh_stats;
+        ++stats.calls;
+        stats.overruns += ticks - 1;
+        if(jitter > stats.max_jitter)
+            stats.max_jitter = (jitter < UINT16_MAX) ? jitter : UINT16_MAX;
+        if(busy > stats.max_busy)
+            stats.max_busy = (busy < UINT16_MAX) ? busy : UINT16_MAX;
+        display->_refresh_jitter_sum += jitter;
+        portEXIT_CRITICAL(&display->_refresh_mux);
+    }
+
+    timerEnd(timer);
+    display->_refresh_task = nullptr;
+    vTaskDelete(nullptr);
+}
+#endif /* ESP32 */
+
+#if PxMATRIX_DITHER_BITS > 0
+void PxMATRIX::renderDither() {
+    // Ordered dithering threshold for 2x2 pixels (Bayer matrix).
+    // Bits of a byte are neighbour pixels in a line, and neighbour lines are sent in neighbour scan lines.
+    static const uint8_t bayer[4] = { 0, 2, 3, 1 };
+    const uint8_t frames = _BV(PxMATRIX_DITHER_BITS);
+
+    // Threshold bit masks for even and odd scan lines.
+    // Threshold is shifted each frame so every pixel passes all levels over the dithering period.
+    uint8_t threshold[2][PxMATRIX_DITHER_BITS];
+    for(uint8_t parity = 0; parity < 2; ++parity) {
+        for(uint8_t i = 0; i < PxMATRIX_DITHER_BITS; ++i)
+            threshold[parity][i] = 0;
+        for(uint8_t bit = 0; bit < 8; ++bit) {
+            uint8_t t = (bayer[(bit & 1) | (parity << 1)] >> (2 - PxMATRIX_DITHER_BITS)) + _dither_phase;
+            t &= frames - 1;
+            for(uint8_t i = 0; i < PxMATRIX_DITHER_BITS; ++i)
+                if(t & _BV(i))
+                    threshold[parity][i] |= _BV(bit);
+        }
+    }
+    _dither_phase = (_dither_phase + 1) & (frames - 1);
+
+    // Process 8 pixels at once with bitwise operations over the bit planes
+    const uint8_t* pSrc = getBuffer(PxMATRIX::Buffer_Type::ACTIVE);
+    uint8_t* pDst = PxMATRIX_dither_buffer;
+    for(uint16_t n = 0; n < _buffer_size; ++n) {
+        const uint8_t* pThreshold = threshold[(n / _send_buffer_size) & 1];
+
+        // Compare dithering bits with the threshold (from the highest bit)
+        uint8_t carry = 0;
+        uint8_t equal = 0xFF;
+        for(int8_t i = PxMATRIX_DITHER_BITS - 1; i >= 0; --i) {
+            uint8_t bits = pSrc[(PxMATRIX_COLOR_DEPTH + i) * _buffer_size + n];
+            carry |= equal & bits & ~pThreshold[i];
+            equal &= ~(bits ^ pThreshold[i]);
+        }
+
+        // Increment displayed level where dithering bits are above the threshold
+        uint8_t level[PxMATRIX_COLOR_DEPTH];
+        for(uint8_t i = 0; i < PxMATRIX_COLOR_DEPTH; ++i) {
+            uint8_t bits = pSrc[i * _buffer_size + n];
+            level[i] = bits ^ carry;
+            carry &= bits;
+        }
+        // Saturate overflowed levels
+        for(uint8_t i = 0; i < PxMATRIX_COLOR_DEPTH; ++i)
+            pDst[i * _buffer_size + n] = level[i] | carry;
+    }
+}
+#endif /* PxMATRIX_DITHER_BITS */
+
+void PxMATRIX::beginPlane(uint16_t show_time) {
     if(show_time == 0)
         show_time = 1;
+    if(show_time != _program_show_time || _brightness != _program_brightness)
+        compileProgram(show_time);
 
     // How long do we keep the pixels on
-    uint16_t latch_time = getLatchTime(show_time);
+    uint16_t latch_time = _plane_time[_display_color];
 
 #ifdef ESP8266
     ESP.wdtFeed();
 #endif
 
-    unsigned long start_time = 0;
-    uint8_t* pBuffer = getBuffer(PxMATRIX::Buffer_Type::ACTIVE);
-    for(uint8_t row = 0; row < _row_pattern; ++row) {
-        if(_fast_update && _brightness == 255 && _LATCH_PINS.size == 1) {
-            // This will clock data into the display while the outputs are still
-            // latched (LEDs on). We therefore utilize SPI transfer latency as LED
-            // ON time and can reduce the waiting time (show_time). This is rather
-            // timing sensitive and may lead to flicker however promises reduced
-            // update times and increased brightness
-
-            set_mux(row);
-            digitalWrite(_LATCH_PINS[0], HIGH ^ PxMATRIX_LATCH_INVERT);
-            digitalWrite(_LATCH_PINS[0], LOW ^ PxMATRIX_LATCH_INVERT);
-            digitalWrite(_OE_PIN, LOW ^ PxMATRIX_OE_INVERT);
-            start_time = micros();
-            delayMicroseconds(1);
-            if(row < _row_pattern - 1) {
-                // This pre-buffers the data for the next row pattern of this _display_color
-                SPI_BUFFER(&pBuffer[_display_color * _buffer_size + (row + 1) * _send_buffer_size], _send_buffer_size);
-            } else {
-                // This pre-buffers the data for the first row pattern of the next _display_color
-                SPI_BUFFER(&pBuffer[((_display_color + 1) % PxMATRIX_COLOR_DEPTH) * _buffer_size], _send_buffer_size);
-            }
-
-            while((micros() - start_time) < latch_time)
-                delayMicroseconds(1);
+#if PxMATRIX_DITHER_BITS > 0
+    if(_display_color == 0)
+        renderDither();
+    _scan_buffer = PxMATRIX_dither_buffer;
+    // Dithering may change any displayed plane
+    _scan_plane_mask = PxMATRIX_PLANES_MASK;
+#else
+    _scan_buffer = getBuffer(PxMATRIX::Buffer_Type::ACTIVE);
+    _scan_plane_mask = _BV(_display_color);
+#endif
+    _scan_row = 0;
+    _scan_latch_time = latch_time;
 
-            digitalWrite(_OE_PIN, HIGH ^ PxMATRIX_OE_INVERT);
-        } else {
-            set_mux(row);
+    if(_blank_boost && !_scan_full) {
+        // Spread the time of blank rows over the rows with lit pixels
+        const uint8_t* pLitPlanes = getLitPlanes(PxMATRIX::Buffer_Type::ACTIVE);
+        uint8_t lit_rows = 0;
+        for(uint8_t row = 0; row < _row_pattern; ++row) {
             for(uint8_t line = 0; line < _LATCH_PINS.size; ++line) {
-                SPI_BUFFER(&pBuffer[_display_color * _buffer_size + (_row_pattern * line + row) * _send_buffer_size], _send_buffer_size);
-                latch(0, line); // latch pulse
+                if(pLitPlanes[_row_pattern * line + row] & _scan_plane_mask) {
+                    ++lit_rows;
+                    break;
+                }
             }
-            latch(latch_time, LATCH_NONE); // delay
+        }
+        if(lit_rows > 0) {
+            uint32_t boost_time = (uint32_t)latch_time * _row_pattern / lit_rows;
+            _scan_latch_time = (boost_time < UINT16_MAX) ? boost_time : UINT16_MAX;
         }
     }
+}
+
+bool PxMATRIX::nextRow() {
+    // Scan lines without lit pixels in the current bit plane are not displayed
+    const uint8_t* pLitPlanes = getLitPlanes(PxMATRIX::Buffer_Type::ACTIVE);
+    const uint8_t lines = _LATCH_PINS.size;
+    for(; _scan_row < _row_pattern; ++_scan_row) {
+        const uint8_t row = _scan_row;
+        bool blank_row = true;
+        for(uint8_t line = 0; line < lines; ++line) {
+            if(pLitPlanes[_row_pattern * line + row] & _scan_plane_mask) {
+                blank_row = false;
+                break;
+            }
+        }
+        if(blank_row && !_scan_full)
+            continue;
+
+        set_mux(row);
+        const uint8_t* pRow = &_scan_buffer[_display_color * _buffer_size + row * _send_buffer_size];
+        for(uint8_t line = 0; line < lines; ++line) {
+            uint8_t index = _row_pattern * line + row;
+            bool blank = !(pLitPlanes[index] & _scan_plane_mask) && !_scan_full;
+            if(blank && line < 16 && (_blank_lines & _BV(line)))
+                continue; // registers already hold blank data
+            SPI_BUFFER(&pRow[line * _row_pattern * _send_buffer_size], _send_buffer_size);
+            latch(0, line); // latch pulse
+            if(blank && line < 16)
+                _blank_lines |= _BV(line);
+        }
+        ++_scan_row;
+        return true;
+    }
+    endPlane();
+    return false;
+}
+
+void PxMATRIX::endPlane() {
     ++_display_color;
     if(_display_color >= PxMATRIX_COLOR_DEPTH)
         _display_color = 0;
 }
 
+void PxMATRIX::output(bool enable) {
+    digitalWrite(_OE_PIN, (enable ? LOW : HIGH) ^ PxMATRIX_OE_INVERT);
+}
+
+void PxMATRIX::display(uint16_t show_time) {
+    beginPlane(show_time);
+
+    if(!(_fast_update && _brightness == 255 && _LATCH_PINS.size == 1)) {
+        while(nextRow())
+            latch(_scan_latch_time, LATCH_NONE); // delay
+        return;
+    }
+
+    // This will clock data into the display while the outputs are still
+    // latched (LEDs on). We therefore utilize SPI transfer latency as LED
+    // ON time and can reduce the waiting time (show_time). This is rather
+    // timing sensitive and may lead to flicker however promises reduced
+    // update times and increased brightness
+    uint16_t latch_time = _plane_time[_display_color];
+    uint8_t* pBuffer = _scan_buffer;
+    unsigned long start_time = 0;
+    for(uint8_t row = 0; row < _row_pattern; ++row) {
+        set_mux(row);
+        digitalWrite(_LATCH_PINS[0], HIGH ^ PxMATRIX_LATCH_INVERT);
+        digitalWrite(_LATCH_PINS[0], LOW ^ PxMATRIX_LATCH_INVERT);
+        _blank_lines = 0;
+        digitalWrite(_OE_PIN, LOW ^ PxMATRIX_OE_INVERT);
+        start_time = micros();
+        delayMicroseconds(1);
+        if(row < _row_pattern - 1) {
+            // This pre-buffers the data for the next row pattern of this _display_color
+            SPI_BUFFER(&pBuffer[_display_color * _buffer_size + (row + 1) * _send_buffer_size], _send_buffer_size);
+        } else {
+            // This pre-buffers the data for the first row pattern of the next _display_color
+            SPI_BUFFER(&pBuffer[((_display_color + 1) % PxMATRIX_COLOR_DEPTH) * _buffer_size], _send_buffer_size);
+        }
+
+        while((micros() - start_time) < latch_time)
+            delayMicroseconds(1);
+
+        digitalWrite(_OE_PIN, HIGH ^ PxMATRIX_OE_INVERT);
+    }
+    endPlane();
+}
+
 void PxMATRIX::flushDisplay(void) {
     for(uint16_t i = 0; i < _send_buffer_size; ++i)
         SPI_BYTE(PxMATRIX_DATA_CLEAR);
     latch(0, LATCH_ALL);
+    _blank_lines = UINT16_MAX;
 }
 
 void PxMATRIX::clearDisplay(PxMATRIX::Buffer_Type selected_buffer) {
     uint8_t* pBuffer = getBuffer(selected_buffer);
-    memset(pBuffer, PxMATRIX_DATA_CLEAR, PxMATRIX_COLOR_DEPTH * _buffer_size);
+    memset(pBuffer, PxMATRIX_DATA_CLEAR, PxMATRIX_BUFFER_PLANES * _buffer_size);
+    memset(getLitPlanes(selected_buffer), 0, _row_pattern * _LATCH_PINS.size);
+#ifdef PxMATRIX_SHADOW_BUFFER
+    // Drawing starts over with black image
+    memset(PxMATRIX_shadow_buffer, 0, (uint32_t)WIDTH * HEIGHT);
+    memset(getShadowDirty(selected_buffer), 0, (HEIGHT + 7) / 8);
+    for(uint8_t i = 0; i < PxMATRIX_BUFFER_COUNT; ++i) {
+        uint8_t* pDirty = _shadow_dirty + i * ((HEIGHT + 7) / 8);
+        if(pDirty != getShadowDirty(selected_buffer))
+            memset(pDirty, 0xFF, (HEIGHT + 7) / 8);
+    }
+#endif
 }
 
 #endif /* _PxMATRIX_IMPL_H */
\ No newline at end of file
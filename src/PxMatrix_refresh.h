@@ -0,0 +1,76 @@
+/*********************************************************************
+This is a library for Chinese LED matrix displays
+
+Originally written for RGB panels by Dominic Buchstaller.
+Adapted for monochrome HUB12 1R panels by tort32@github.
+BSD license, check LICENSE for more information
+*********************************************************************/
+
+#ifndef _PxMATRIX_REFRESH_H
+#define _PxMATRIX_REFRESH_H
+
+// Refresh calibration math (see PxMATRIX::calibrateRefresh)
+// NOTE: it has no Arduino dependencies, so it can be included and tested on the host
+
+#include <stdint.h>
+
+// Timings of display refresh in microseconds (see PxMATRIX::measureRefresh)
+struct PxMATRIX_Refresh_Timing {
+    uint16_t spi_time;  // Send scan line data to the registers of a latch line and latch it
+    uint16_t mux_time;  // Select scan line (including mux delays)
+    uint16_t call_time; // Rest of display call (without scan lines)
+};
+
+// Refresh settings for the target refresh rate
+struct PxMATRIX_Refresh_Settings {
+    uint16_t show_time;    // Argument for display method
+    uint16_t timer_period; // Period of the timer calling display method in microseconds
+    uint16_t refresh_rate; // Resulting refresh rate of whole frame (all bit planes) in Hz
+    uint16_t busy_time;    // Duration of the longest display call in microseconds
+    uint16_t idle_time;    // Time left for application within the timer period of the longest display call (headroom)
+};
+
+// Compute the longest show time that keeps refresh rate (frames per second with all bit planes)
+// color_depth = number of bit planes (PxMATRIX_COLOR_DEPTH), lines = number of latch lines
+// max_load = percent of timer period that the longest display call may take (the rest is left to application)
+// Returns false if refresh rate can't be reached (or arguments are zero)
+inline bool PxMATRIX_calibrateRefresh(const PxMATRIX_Refresh_Timing& timing, uint16_t refresh_rate, uint8_t color_depth,
+                                      uint8_t row_pattern, uint8_t lines, PxMATRIX_Refresh_Settings& settings, uint8_t max_load = 75) {
+    if(refresh_rate == 0 || color_depth == 0 || row_pattern == 0)
+        return false;
+
+    // Each display call renders a single bit plane
+    uint32_t period = 1000000UL / ((uint32_t)refresh_rate * color_depth);
+    if(period > UINT16_MAX)
+        period = UINT16_MAX;
+    uint32_t budget = period * max_load / 100;
+    uint32_t fixed_time = timing.call_time + (uint32_t)row_pattern * (timing.mux_time + (uint32_t)lines * timing.spi_time);
+
+    settings.timer_period = period;
+    settings.refresh_rate = 1000000UL / (period * color_depth);
+    settings.show_time = 0;
+    settings.busy_time = (fixed_time < UINT16_MAX) ? fixed_time : UINT16_MAX;
+    settings.idle_time = 0;
+    if(fixed_time >= budget)
+        return false;
+
+    // The last bit plane has the longest latch time (see PxMATRIX::getLatchTime)
+    uint32_t latch_time = (budget - fixed_time) / row_pattern;
+    uint32_t show_time = (color_depth == 1) ? latch_time : ((latch_time * 2) >> (color_depth - 1));
+#ifdef __AVR__
+    if(show_time >= (65535U >> (color_depth - 1)))
+        show_time = (65535U >> (color_depth - 1));
+#endif
+    if(show_time > UINT16_MAX)
+        show_time = UINT16_MAX;
+    if(show_time == 0)
+        return false;
+    latch_time = (color_depth == 1) ? show_time : ((show_time << (color_depth - 1)) / 2);
+
+    settings.show_time = show_time;
+    settings.busy_time = fixed_time + row_pattern * latch_time;
+    settings.idle_time = period - settings.busy_time;
+    return true;
+}
+
+#endif /* _PxMATRIX_REFRESH_H */
@@ -0,0 +1,188 @@
+/*********************************************************************
+This is a library for Chinese LED matrix displays
+
+Originally written for RGB panels by Dominic Buchstaller.
+Adapted for monochrome HUB12 1R panels by tort32@github.
+BSD license, check LICENSE for more information
+*********************************************************************/
+
+#ifndef _PxMATRIX_SCHEDULER_H
+#define _PxMATRIX_SCHEDULER_H
+
+#include "PxMatrix.h"
+
+// Maximum number of displays driven by a scheduler
+#ifndef PxMATRIX_SCHEDULER_MAX
+#define PxMATRIX_SCHEDULER_MAX 4
+#endif
+
+#ifdef ESP8266
+#include <Ticker.h>
+#endif
+
+// Refresh scheduler for multiple displays sharing the SPI bus
+// Each display has its own latch, output enable and mux pins, geometry and scan pattern.
+// Data and clock lines can be shared: registers of other displays are shifted too, but not latched.
+// Data of a display is sent while other displays are lit, so SPI transfers overlap with show time.
+// Transfer is started only if the lit displays are not due to turn off before it ends (to keep bit planes timing).
+// NOTE: fast update mode is not used by the scheduler.
+class PxMATRIX_Scheduler
+{
+public:
+    inline PxMATRIX_Scheduler() : _count{0} {}
+
+    // Register display to refresh with given show time (see PxMATRIX::display)
+    // Scan line transfer time is measured (see PxMATRIX::measureRefresh), so call it before the timer is started.
+    // Returns false if maximum number of displays is reached
+    inline bool add(PxMATRIX& display, uint16_t show_time = PxMATRIX_DEFAULT_SHOWTIME);
+
+    // Render a bit plane of all displays
+    // Call it from the timer interruption (or use "start" method)
+    inline void update();
+
+#if defined(ESP32) || defined(ESP8266)
+    // Start the timer calling update method with period in microseconds
+    // Frame refresh rate for each display is 1000000 / (period * PxMATRIX_COLOR_DEPTH)
+    inline void start(uint32_t period);
+
+    // Stop the timer
+    inline void stop();
+#endif
+
+private:
+    PxMATRIX* _displays[PxMATRIX_SCHEDULER_MAX];
+    uint16_t  _show_time[PxMATRIX_SCHEDULER_MAX];
+    // The longest time to send and latch a scan line of the display in microseconds
+    uint16_t  _row_time[PxMATRIX_SCHEDULER_MAX];
+    uint8_t   _count;
+
+#ifdef ESP32
+    hw_timer_t*  _timer = nullptr;
+    portMUX_TYPE _timer_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+#ifdef ESP8266
+    Ticker _ticker;
+#endif
+
+#if defined(ESP32) || defined(ESP8266)
+    // Scheduler started by timer
+    static inline PxMATRIX_Scheduler*& instance() {
+        static PxMATRIX_Scheduler* scheduler = nullptr;
+        return scheduler;
+    }
+
+    static inline void on_timer();
+#endif
+};
+
+inline bool PxMATRIX_Scheduler::add(PxMATRIX& display, uint16_t show_time) {
+    if(_count >= PxMATRIX_SCHEDULER_MAX)
+        return false;
+    PxMATRIX::Refresh_Timing timing = display.measureRefresh();
+    _displays[_count] = &display;
+    _show_time[_count] = show_time;
+    _row_time[_count] = timing.mux_time + display._LATCH_PINS.size * timing.spi_time;
+    ++_count;
+    return true;
+}
+
+inline void PxMATRIX_Scheduler::update() {
+    unsigned long start_time[PxMATRIX_SCHEDULER_MAX];
+    bool lit[PxMATRIX_SCHEDULER_MAX];
+    bool done[PxMATRIX_SCHEDULER_MAX];
+    uint8_t remaining = _count;
+    for(uint8_t i = 0; i < _count; ++i) {
+        _displays[i]->beginPlane(_show_time[i]);
+        lit[i] = false;
+        done[i] = false;
+    }
+
+    // Send the next scan line of any display which has finished showing the previous one,
+    // so the bus is busy while the other displays are lit
+    while(remaining > 0) {
+        for(uint8_t i = 0; i < _count; ++i) {
+            if(done[i])
+                continue;
+            PxMATRIX* display = _displays[i];
+            if(lit[i]) {
+                if((micros() - start_time[i]) < display->_scan_latch_time)
+                    continue;
+                display->output(false);
+                lit[i] = false;
+            }
+
+            // Transfer blocks the loop, so wait for lit displays which are due to turn off before it ends
+            unsigned long now = micros();
+            bool wait = false;
+            for(uint8_t j = 0; j < _count && !wait; ++j)
+                wait = lit[j] && (now - start_time[j]) + _row_time[i] >= _displays[j]->_scan_latch_time;
+            if(wait)
+                continue;
+
+            bool row = display->nextRow();
+            unsigned long row_time = micros() - now;
+            if(row_time > _row_time[i])
+                _row_time[i] = (row_time < UINT16_MAX) ? row_time : UINT16_MAX;
+            if(row) {
+                display->output(true);
+                start_time[i] = micros();
+                lit[i] = true;
+            } else {
+                // Bit plane is done
+                done[i] = true;
+                --remaining;
+            }
+        }
+    }
+}
+
+#if defined(ESP32) || defined(ESP8266)
+inline void IRAM_ATTR PxMATRIX_Scheduler::on_timer() {
+    PxMATRIX_Scheduler* scheduler = instance();
+    if(scheduler == nullptr)
+        return;
+#ifdef ESP32
+    portENTER_CRITICAL_ISR(&scheduler->_timer_mux);
+#endif
+    scheduler->update();
+#ifdef ESP32
+    portEXIT_CRITICAL_ISR(&scheduler->_timer_mux);
+#endif
+}
+
+inline void PxMATRIX_Scheduler::start(uint32_t period) {
+    stop();
+    instance() = this;
+#ifdef ESP32
+    #if ESP_ARDUINO_VERSION_MAJOR <= 2
+        _timer = timerBegin(0, 80, true);
+        timerAttachInterrupt(_timer, &on_timer, true);
+        timerAlarmWrite(_timer, period, true);
+        timerAlarmEnable(_timer);
+    #else
+        _timer = timerBegin(1000000);
+        timerAttachInterrupt(_timer, &on_timer);
+        timerAlarm(_timer, period, true, 0);
+    #endif
+#endif
+#ifdef ESP8266
+    _ticker.attach(period / 1000000.0f, &on_timer);
+#endif
+}
+
+inline void PxMATRIX_Scheduler::stop() {
+#ifdef ESP32
+    if(_timer != nullptr) {
+        timerEnd(_timer);
+        _timer = nullptr;
+    }
+#endif
+#ifdef ESP8266
+    _ticker.detach();
+#endif
+    if(instance() == this)
+        instance() = nullptr;
+}
+#endif /* ESP32 || ESP8266 */
+
+#endif /* _PxMATRIX_SCHEDULER_H */